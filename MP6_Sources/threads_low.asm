@@ -9,6 +9,7 @@
 
 ; ----------------------------------------------------------------------
 ; threads_low_switch_to(Thread * _thread)
+; threads_low_switch_to_iret(Thread * _thread)
 ; 
 ; If the calling entity is a thread, we save its context. 
 ; Then we load the context of the new thread, and continue executing
@@ -23,6 +24,7 @@ KERNEL_DS equ 2<<3	; kernel data segment is GDT entry 2
 
 
 INTERRUPT_STATE_SIZE equ 68 ; size of exception frame on stack
+CONTEXT_SIZE equ 24         ; size of saved context (see below)
 
 ; Save registers prior to calling a handler function.
 ; This must be kept up to date with:
@@ -49,20 +51,102 @@ INTERRUPT_STATE_SIZE equ 68 ; size of exception frame on stack
 
 extern _current_thread  ; defined and initialized in threads.c
 
+; ----------------------------------------------------------------------
+; SAVED CONTEXT
+;
+; The stack of a thread that is not running looks like this:
+;
+;            resume addr
+;            eflags
+;            ebp
+;            ebx
+;            esi
+;    esp --> edi
+;
+; and the esp is stored in the thread (at offset 0). A context is loaded
+; by popping the registers and returning to the resume address.
+;
+; - A thread that was switched out by threads_low_switch_to resumes
+;   right after its call to threads_low_switch_to. These are the only
+;   registers that the C calling convention asks us to preserve.
+; - A new thread, or one that was switched out by
+;   threads_low_switch_to_iret, has a full exception frame below this
+;   context, and resumes in threads_low_resume_from_frame, which
+;   restores the frame with an iret.
+; ----------------------------------------------------------------------
+
 
 global _threads_low_switch_to
 align 16
 ; this function is exported.
 _threads_low_switch_to:
 
+	; Fast path: save only the callee-saved registers.
+
+	mov	eax, [esp+4]		; the new thread
+	mov	edx, [_current_thread]
 
         ; Is this a full-blown context switch, or is this just the start-up
 	; thread giving control to the first real thread? If the latter, we 
-	; don't need to do anything with setting up and saving the current
-        ; context. We simply proceed to loading the new context. 
+	; don't need to save the current context.
+
+	test	edx, edx
+	jz	threads_low_load_context
+
+	pushfd
+	push	ebp
+	push	ebx
+	push	esi
+	push	edi
+
+	; Save stack pointer in the thread context struct (at offset 0).
+	mov	[edx+0], esp
+
+	; fall through
+
+threads_low_load_context:
+
+	; eax points to the new thread.
+	; Make the new thread current, and switch to its stack.
+	mov	[_current_thread], eax
+	mov	esp, [eax+0]
+
+	pop	edi
+	pop	esi
+	pop	ebx
+	pop	ebp
+	popfd
+
+	; We'll return to the place where the thread was
+	; executing last.
+	ret
+
+
+global _threads_low_resume_from_frame
+align 16
+; Resume address of contexts with a full exception frame.
+_threads_low_resume_from_frame:
+
+	; Restore general purpose and segment registers, and clear interrupt
+	; number and error code.
+	restore_registers
+
+	iret
+
+
+global _threads_low_switch_to_iret
+align 16
+; The original switch, which saves a full exception frame. The fast path
+; above is all we need; this one is kept to compare the two.
+_threads_low_switch_to_iret:
 
 	cmp	[_current_thread], dword 0
-	je	.context_load_only
+	jne	.save_frame
+
+	mov	eax, [esp+4]
+	jmp	threads_low_load_context
+
+.save_frame:
 
 	; Modify the stack to allow a later return via an iret instruction.
 	; We start with a stack that looks like this:
@@ -94,41 +178,21 @@ _threads_low_switch_to:
 	; Save general purpose registers.
 	save_registers
 
+	; On top of the frame, a context that resumes by restoring the frame.
+	push	dword _threads_low_resume_from_frame
+	pushfd
+	push	dword 0		; ebp
+	push	dword 0		; ebx
+	push	dword 0		; esi
+	push	dword 0		; edi
+
 	; Save stack pointer in the thread context struct (at offset 0).
 	mov	eax, [_current_thread]
 	mov	[eax+0], esp
 
 	; Load the pointer to the new thread context into eax.
-	; We skip over the Interrupt_State struct on the stack to
-	; get the parameter.
-	mov	eax, dword [esp+INTERRUPT_STATE_SIZE]
-
-	; Make the new thread current, and switch to its stack.
-	mov	[_current_thread], eax
-	mov	esp, [eax+0]
-
-	; Restore general purpose and segment registers, and clear interrupt
-	; number and error code.
-	restore_registers
+	; We skip over the Interrupt_State struct and the context on the
+	; stack to get the parameter.
+	mov	eax, dword [esp+INTERRUPT_STATE_SIZE+CONTEXT_SIZE]
 
-	; We'll return to the place where the thread was
-	; executing last.
-	iret
-
-.context_load_only:
-
-	; We skipped the whole exception frame setup, and just need to 
-        ; store the thread pointer into eax.
-        mov	eax, [esp+4]
-
-	; Make the new thread current, and switch to its stack.
-	mov	[_current_thread], eax
-	mov	esp, [eax+0]
-
-	; Restore general purpose and segment registers, and clear interrupt
-	; number and error code.
-	restore_registers
-
-	; We'll return to the place where the thread was
-	; executing last.
-	iret
+	jmp	threads_low_load_context